@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Time each ptsim build over the same workload and report the speedup
+# relative to the first one.
+#
+# usage: bench.sh workload binary [binary ...]
+#
+
+RUNS=${RUNS:-200}
+
+workload=$1
+shift
+
+cmds=$(grep -v '^#' "$workload")
+
+base=
+for bin in "$@"; do
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        # shellcheck disable=SC2086
+        ./"$bin" $cmds > /dev/null
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+
+    ns=$((end - start))
+    [ -z "$base" ] && base=$ns
+
+    awk -v bin="$bin" -v ns="$ns" -v base="$base" -v runs="$RUNS" 'BEGIN {
+        printf "%-16s %8.1f us/run  speedup %.2fx\n",
+            bin, ns / runs / 1000, base / ns
+    }'
+done
@@ -2,140 +2,2209 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 
 #define MEM_SIZE 16384  // MUST equal PAGE_SIZE * PAGE_COUNT
 #define PAGE_SIZE 256  // MUST equal 2^PAGE_SHIFT
 #define PAGE_COUNT 64
 #define PAGE_SHIFT 8  // Shift page number this much
+#define OFFSET_MASK (PAGE_SIZE - 1)  // Low bits of an address are the offset
 
 #define PTP_OFFSET 64 // How far offset in page 0 is the page table pointer table
+#define MAX_PROCS (PAGE_SIZE - PTP_OFFSET)
+
+#define SECTION_PAGES 16 // Hotplug granularity, in pages
+#ifndef BOOT_PAGES
+#define BOOT_PAGES PAGE_COUNT // Pages online at boot, whole sections
+#endif
+
+#define PAGEBLOCK_PAGES 16 // Migratetype grouping granularity, in pages
+#define PAGEBLOCK_COUNT (PAGE_COUNT / PAGEBLOCK_PAGES)
+#define PT_REGION_PAGES PAGEBLOCK_PAGES // Pages reserved for page tables
+#define MAX_ORDER 4  // Largest aligned run reported is 2^MAX_ORDER pages
+#define MAX_RANGES 4  // Range translations per process
+#define LARGE_PAGE_PAGES PAGEBLOCK_PAGES // Pages in a large page
+
+#define TLB_ENTRIES 8
+#define CONTIG_PAGES 16  // PTEs covered by one contiguous-hint TLB entry
+#define CONTIG_GROUPS (PAGE_COUNT / CONTIG_PAGES)
+
+// TLB replacement policies
+#define POLICY_LRU 0
+#define POLICY_2Q 1
+#define POLICY_ARC 2
+#define POLICY_LIRS 3
+#define POLICY_LFU 4
+#define POLICY_LECAR 5
+
+#define NODE_COUNT (3 * TLB_ENTRIES)  // Resident plus ghost nodes
+#define NODE_HASH_BUCKETS 32
+#define FREQ_MAX 15  // LFU frequency counts saturate here
+#define LIST_A 0
+#define LIST_B 1
+#define LIST_C 2
+#define LIST_D 3
+#define LIST_FREQ 4  // LFU buckets: LIST_FREQ + 1 to LIST_FREQ + FREQ_MAX
+#define LIST_COUNT (LIST_FREQ + FREQ_MAX + 1)
+
+#define TWOQ_KIN (TLB_ENTRIES / 4)  // 2Q A1in target size
+#define TWOQ_KOUT (TLB_ENTRIES / 2)  // 2Q A1out ghost limit
+
+#define LIRS_LIR_MAX (TLB_ENTRIES - 1)  // Rest of the TLB holds HIR pages
+#define LIRS_GHOST_MAX TLB_ENTRIES
+
+// LIRS node states
+#define LIRS_LIR 0
+#define LIRS_HIR 1
+#define LIRS_GHOST 2
+
+#define LECAR_RATE 0.45  // LeCaR learning rate
+#define LECAR_DISCOUNT_BASE 0.005  // Regret left after TLB_ENTRIES misses
+#define LECAR_SAMPLE_INTERVAL 64  // Accesses between weight samples
+#define LECAR_SAMPLES 32  // Weight samples kept for tstat
+
+// Migratetypes
+#define MT_MOVABLE 0
+#define MT_UNMOVABLE 1
+#define MT_RECLAIMABLE 2
+
+#define DEV_COUNT 4  // Number of IOMMU domains (devices)
+#define IOTLB_ENTRIES 4  // IOTLB entries per device
+#define FLUSH_QUEUE_SIZE 8  // Lazy-mode unmaps batched per IOTLB flush
 
 // Simulated RAM
 unsigned char mem[MEM_SIZE];
 
+// Pages at or above this are offline (hot-removed)
+int online_pages;
+
+// Free online pages, kept in step with the free map, and how many of
+// them lie in the first PT_REGION_PAGES pages
+int free_pages;
+int region_free_pages;
+
+// Every page below this is allocated, so free page scans start here
+int free_hint;
+
+// Migratetype of each allocated page, and the type each pageblock has
+// been claimed for (-1 if unclaimed). Grouping is off by default.
+int page_type[PAGE_COUNT];
+int pageblock_type[PAGEBLOCK_COUNT];
+int grouping;
+
+// Page table placement: 0 = first-fit, 1 = reserved region next to page 0
+int pt_region;
+
+// Process group of each process, -1 if none
+int proc_group[MAX_PROCS];
+
+// Eager contiguous allocation and per-process range translations: virtual
+// pages [vpage, vpage + count) map to physical pages starting at page.
+// Ranges are checked before the page table, which still holds every PTE.
+int eager;
+
+struct range {
+    int vpage;
+    int count;
+    int page;
+} ranges[MAX_PROCS][MAX_RANGES];
+int range_count[MAX_PROCS];
+
+// Superpage reservations, one per aligned large-page block: the owning
+// process (-1 if none), the virtual large-page region it backs, pages used
+// so far and an age for LRU breaking. Reserved pages not yet used are
+// flagged in reserved[] and stay off the free map.
+int reserve;
+
+struct reservation {
+    int proc;
+    int vregion;
+    int used;
+    int seq;
+} reservations[PAGE_COUNT / LARGE_PAGE_PAGES];
+unsigned char reserved[PAGE_COUNT];
+int reservation_seq;
+int reservations_made, promotions, reservations_broken;
+
+// Direct segment of each process: virtual pages [base, limit) map to
+// physical pages starting at offset, with no PTEs. limit 0 means none.
+struct segment {
+    int base;
+    int limit;
+    int offset;
+} segments[MAX_PROCS];
+
+// Contiguous hint for each aligned group of CONTIG_PAGES PTEs. Set when
+// the group maps CONTIG_PAGES physically contiguous, equally aligned pages
+// so the TLB can cache the whole group as one entry.
+unsigned char contig_hint[MAX_PROCS][CONTIG_GROUPS];
+
+// TLB: each entry maps count virtual pages starting at vpage (1, or
+// CONTIG_PAGES for a contiguous-hint entry) for an ASID, -1 if empty.
+struct tlb_entry {
+    int asid;
+    int vpage;
+    int page;
+    int count;
+    int proc;  // Owning process
+    int last_use;  // LRU
+    int node;  // Replacement node, -1 if none
+} tlb[TLB_ENTRIES];
+int tlb_clock;
+
+// Shadow entries: when a live TLB entry is evicted, the eviction count at
+// that moment is left behind for its process and virtual page, 0 if none.
+// A refault is a miss that finds a shadow; its distance is the number of
+// evictions since.
+int tlb_shadow[MAX_PROCS][PAGE_COUNT];
+int refaults, thrash_refaults, refault_activations;
+
+// Replacement state for 2Q, ARC and LIRS; see repl_fill()
+int tlb_policy;
+
+struct rnode {
+    int key;  // -1 if the node is free
+    int entry;  // TLB entry, -1 for a ghost
+    int state;  // LIRS state, or LFU frequency
+    int stamp;  // When a LeCaR ghost was evicted
+    int hash_next;  // Hash chain, or free pool link
+} nodes[NODE_COUNT];
+
+struct rlink {
+    int prev, next;
+    int list;  // -1 if not on a list
+} links[2][NODE_COUNT];
+
+struct rlist {
+    int head, tail;
+    int size;
+} lists[LIST_COUNT];
+
+int node_hash[NODE_HASH_BUCKETS];
+int node_free;
+int arc_p;  // ARC target size of T1
+int lirs_lir_count;
+
+// LeCaR weight of the LRU expert (LFU's is 1 - this) and its trajectory
+double lecar_w_lru = 0.5;
+double lecar_samples[LECAR_SAMPLES];
+int lecar_sample_count;
+
+// ASIDs are handed out lazily when a process is switched in. Each process
+// keeps its ASID until the generation rolls over, which flushes the whole
+// TLB. With asid_bits 0 there are no ASIDs and every switch flushes.
+int asid_bits = 8;
+int asid_generation = 1;
+int next_asid = 1;
+int proc_asid[MAX_PROCS];
+int proc_asid_gen[MAX_PROCS];  // Generation of proc_asid, 0 if none
+int current_proc = -1;
+int context_switches, tlb_flushes, asid_rollovers;
+
+// Lazy TLB coherence: instead of shooting down a killed process's TLB
+// entries, its pages are deferred and only reused after the next flush
+// epoch (a context switch, or allocation pressure)
+int lazy_tlb;
+int deferred_pages[PAGE_COUNT];
+int deferred_count, deferred_peak;
+int tlb_shootdowns, shootdowns_avoided, flush_epochs;
+
+// Translation statistics
+int range_hits, page_walks, segment_hits;
+int tlb_hits, tlb_misses, tlb_contig_fills, tlb_evictions, ghost_hits;
+
+// Long-term pin count of each page from pin/unpin; pinned pages can't be
+// migrated
+int pin_count[PAGE_COUNT];
+
+// Device references to each page: IOMMU mappings and queued lazy unmaps.
+// These pin the page too, but only the IOMMU drops them.
+int io_pin_count[PAGE_COUNT];
+
+// IOMMU: per-device IO page table (IO page -> frame, 0 = unmapped), IOTLB
+// and lazy-mode flush queue of unmapped IO pages. A queued IO page can't
+// be mapped again and its frame stays pinned until the IOTLB is flushed.
+unsigned char io_page_table[DEV_COUNT][PAGE_COUNT];
+
+struct iotlb_entry {
+    int io_page;  // -1 if the entry is empty
+    int page;
+} iotlb[DEV_COUNT][IOTLB_ENTRIES];
+int iotlb_next[DEV_COUNT];  // Round-robin replacement
+
+struct flush_entry {
+    int io_page;
+    int page;
+} flush_queue[DEV_COUNT][FLUSH_QUEUE_SIZE];
+int flush_queue_len[DEV_COUNT];
+
+int iommu_lazy;  // 0 = strict invalidate on unmap, 1 = lazy flush queue
+int iotlb_hits, iotlb_misses, iotlb_invalidations;
+
+// Pages held by the balloon driver, handed back to the host
+int balloon_pages[PAGE_COUNT];
+int balloon_size;
+
+//
+// Convert a page,offset into an address
+//
+int get_address(int page, int offset)
+{
+    return (page << PAGE_SHIFT) | offset;
+}
+
+//
+// Initialize RAM
+//
+void initialize_mem(void)
+{
+    memset(mem, 0, MEM_SIZE);
+    memset(pin_count, 0, sizeof(pin_count));
+    memset(io_pin_count, 0, sizeof(io_pin_count));
+    memset(io_page_table, 0, sizeof(io_page_table));
+    memset(iotlb, -1, sizeof(iotlb));
+    memset(iotlb_next, 0, sizeof(iotlb_next));
+    memset(flush_queue_len, 0, sizeof(flush_queue_len));
+
+    int zpfree_addr = get_address(0, 0);
+    mem[zpfree_addr] = 1;  // Mark zero page as allocated
+
+    // Sections past BOOT_PAGES start offline, ready for memadd
+    memset(mem + get_address(0, BOOT_PAGES), 1, PAGE_COUNT - BOOT_PAGES);
+
+    online_pages = BOOT_PAGES;
+    free_pages = BOOT_PAGES - 1;
+    region_free_pages = PT_REGION_PAGES - 1;
+    free_hint = 1;
+
+    memset(page_type, 0, sizeof(page_type));
+    memset(pageblock_type, -1, sizeof(pageblock_type));
+    page_type[0] = MT_UNMOVABLE;
+    pageblock_type[0] = MT_UNMOVABLE;
+
+    memset(proc_group, -1, sizeof(proc_group));
+    memset(range_count, 0, sizeof(range_count));
+    memset(segments, 0, sizeof(segments));
+    memset(contig_hint, 0, sizeof(contig_hint));
+    memset(tlb_shadow, 0, sizeof(tlb_shadow));
+
+    for (int i = 0; i < TLB_ENTRIES; i++)
+        tlb[i].asid = -1;
+    memset(proc_asid_gen, 0, sizeof(proc_asid_gen));
+
+    for (int b = 0; b < PAGE_COUNT / LARGE_PAGE_PAGES; b++)
+        reservations[b].proc = -1;
+    memset(reserved, 0, sizeof(reserved));
+    balloon_size = 0;
+}
+
+//
+// Return 1 if proc_num names a process slot, or print an error and return 0
+//
+// Per-process arrays are sized MAX_PROCS, so check before indexing them.
+//
+int valid_proc(int proc_num)
+{
+    if (proc_num >= 0 && proc_num < MAX_PROCS)
+        return 1;
+
+    printf("Error: Invalid process %d\n", proc_num);
+    return 0;
+}
+
+//
+// Get the page table page for a given process
+//
+unsigned char get_page_table(int proc_num)
+{
+    int ptp_addr = get_address(0, PTP_OFFSET + proc_num);
+    return mem[ptp_addr];
+}
+
+//
+// Set the page table page for a given process (0 for no process)
+//
+// This and set_pte() are the only places live page tables are written.
+// free_page() also clears a page table page, but only once it has been
+// unlinked. migrate_page() copies one into a new page before linking the
+// copy in here.
+//
+void set_page_table(int proc_num, int pt_page)
+{
+    int ptp_addr = get_address(0, PTP_OFFSET + proc_num);
+    mem[ptp_addr] = pt_page;
+}
+
+//
+// Set the page table entry for a virtual page (0 to unmap it)
+//
+void set_pte(int pt_page, int virtual_page, int page)
+{
+    mem[get_address(pt_page, virtual_page)] = page;
+}
+
+//
+// Free map helpers
+//
+// The free map is one byte per page at the start of page 0, 0 meaning
+// free. These work on whole ranges [start, end) of it with memchr, memset
+// and simple counting loops, which libc and the compiler vectorize.
+//
+
+//
+// Return the first free page in [start, end), or -1
+//
+int free_map_find(int start, int end)
+{
+    if (start >= end)
+        return -1;
+
+    unsigned char *map = mem + get_address(0, 0);
+    unsigned char *p = memchr(map + start, 0, end - start);
+
+    return p == NULL? -1: p - map;
+}
+
+//
+// Return the number of free pages in [start, end)
+//
+int free_map_count(int start, int end)
+{
+    unsigned char *map = mem + get_address(0, 0);
+    int count = 0;
+
+    for (int i = start; i < end; i++)
+        count += map[i] == 0;
+
+    return count;
+}
+
+//
+// Return the length of the run of free pages beginning at start
+//
+int free_map_run(int start, int end)
+{
+    unsigned char *map = mem + get_address(0, 0);
+    int i = start;
+
+    while (i < end && map[i] == 0)
+        i++;
+
+    return i - start;
+}
+
+//
+// Mark every page in [start, end) free (0) or allocated (1)
+//
+void free_map_set(int start, int end, int val)
+{
+    memset(mem + get_address(0, start), val, end - start);
+}
+
+//
+// Take a free page off the free map
+//
+void take_page(int page, int type)
+{
+    mem[get_address(0, page)] = 1; // Mark page as allocated
+    page_type[page] = type;
+    free_pages--;
+    if (page < PT_REGION_PAGES)
+        region_free_pages--;
+
+    if (page == free_hint)
+        free_hint = page + 1;
+}
+
+//
+// Free a page
+//
+// The page contents are cleared so the next owner never sees stale data
+// or, for page table pages, stale mappings.
+//
+void free_page(int page)
+{
+    memset(mem + get_address(page, 0), 0, PAGE_SIZE);
+    mem[get_address(0, page)] = 0; // Mark page as free
+    pin_count[page] = 0;
+    io_pin_count[page] = 0;
+    free_pages++;
+    if (page < PT_REGION_PAGES)
+        region_free_pages++;
+
+    if (page < free_hint)
+        free_hint = page;
+}
+
+//
+// Return the first free online page in [start, end), or -1
+//
+int find_free_page(int start, int end)
+{
+    int from_hint = start <= free_hint;
+
+    if (start < free_hint)
+        start = free_hint;
+    if (end > online_pages)
+        end = online_pages;
+
+    int page = free_map_find(start, end);
+
+    if (page != -1 && from_hint)
+        free_hint = page;
+
+    return page;
+}
+
+//
+// Return the number of free pages in a pageblock
+//
+int pageblock_free_pages(int block)
+{
+    int first = block * PAGEBLOCK_PAGES;
+    int end = first + PAGEBLOCK_PAGES;
+
+    return free_map_count(first, end < online_pages? end: online_pages);
+}
+
+//
+// Allocate a free page of the given migratetype
+//
+// Without grouping this is plain first-fit. With grouping, pages come from
+// pageblocks already claimed for the type, then from a completely free
+// pageblock which is claimed for the type, and only then are they stolen
+// from any pageblock.
+//
+// With the page table region on, the first PT_REGION_PAGES pages are
+// only handed out to page tables, which try them first.
+//
+// Returns the page number, or -1 if there are no free pages.
+//
+int alloc_page(int type)
+{
+    int page = -1;
+    int first = 0;
+
+    if (pt_region) {
+        if (type == MT_UNMOVABLE)
+            page = find_free_page(0, PT_REGION_PAGES);
+        else
+            first = PT_REGION_PAGES;
+    }
+
+    if (grouping) {
+        for (int b = first / PAGEBLOCK_PAGES; b < PAGEBLOCK_COUNT && page == -1; b++) {
+            if (pageblock_type[b] == type)
+                page = find_free_page(b * PAGEBLOCK_PAGES, (b + 1) * PAGEBLOCK_PAGES);
+        }
+
+        for (int b = first / PAGEBLOCK_PAGES; b < PAGEBLOCK_COUNT && page == -1; b++) {
+            if (pageblock_free_pages(b) == PAGEBLOCK_PAGES) {
+                pageblock_type[b] = type;
+                page = b * PAGEBLOCK_PAGES;
+            }
+        }
+    }
+
+    if (page == -1)
+        page = find_free_page(first, online_pages);
+
+    if (page != -1)
+        take_page(page, type);
+
+    return page;
+}
+
+//
+// Return how many more free pages are needed to allocate tables page
+// table pages and data data pages, 0 if they fit
+//
+// With the page table region on, data pages can't use the region, while
+// page tables can use any free page.
+//
+int pages_short(int tables, int data)
+{
+    int short_all = tables + data - free_pages;
+    int short_data = data - (pt_region? free_pages - region_free_pages: free_pages);
+    int need = short_all > short_data? short_all: short_data;
+
+    return need > 0? need: 0;
+}
+
+//
+// TLB replacement policies
+//
+// LRU uses the entries' last_use stamps. 2Q, ARC and LIRS keep their
+// state in a pool of nodes, one per resident TLB entry plus ghost nodes
+// for recently evicted keys. Nodes sit on intrusive doubly linked lists
+// (head is most recent) and ghosts are found through a small hash map, so
+// every access and fill is O(1) apart from the TLB's own associative
+// search. A key is an ASID and the first virtual page of the entry.
+//
+// List roles per policy:
+//   2Q:   LIST_A = A1in (FIFO), LIST_B = Am (LRU), LIST_C = A1out (ghosts)
+//   ARC:  LIST_A = T1, LIST_B = T2, LIST_C = B1, LIST_D = B2
+//   LIRS: LIST_A = stack S, LIST_B = queue Q of resident HIR nodes (link
+//         set 1), LIST_C = FIFO of non-resident HIR nodes (link set 1)
+//   LFU and LeCaR: LIST_A = recency (LRU), LIST_FREQ + f = nodes used f
+//         times (link set 1), LIST_C / LIST_D = ghosts evicted by the LRU
+//         / LFU expert (LeCaR only)
+//
+
+//
+// Return the replacement key of an ASID and virtual page
+//
+int repl_key(int asid, int virtual_page)
+{
+    return asid * PAGE_COUNT + virtual_page;
+}
+
+//
+// Unlink a node from whatever list it's on in a link set
+//
+void list_unlink(int set, int n)
+{
+    struct rlink *k = &links[set][n];
+    struct rlist *l;
+
+    if (k->list == -1)
+        return;
+
+    l = &lists[k->list];
+
+    if (k->prev != -1)
+        links[set][k->prev].next = k->next;
+    else
+        l->head = k->next;
+
+    if (k->next != -1)
+        links[set][k->next].prev = k->prev;
+    else
+        l->tail = k->prev;
+
+    l->size--;
+    k->list = -1;
+}
+
+//
+// Put a node at the head (most recent end) of a list
+//
+void list_push(int set, int list, int n)
+{
+    struct rlink *k = &links[set][n];
+    struct rlist *l = &lists[list];
+
+    list_unlink(set, n);
+
+    k->list = list;
+    k->prev = -1;
+    k->next = l->head;
+
+    if (l->head != -1)
+        links[set][l->head].prev = n;
+    else
+        l->tail = n;
+
+    l->head = n;
+    l->size++;
+}
+
+//
+// Put a node at the tail (least recent end) of a list
+//
+void list_append(int set, int list, int n)
+{
+    struct rlink *k = &links[set][n];
+    struct rlist *l = &lists[list];
+
+    list_unlink(set, n);
+
+    k->list = list;
+    k->next = -1;
+    k->prev = l->tail;
+
+    if (l->tail != -1)
+        links[set][l->tail].next = n;
+    else
+        l->head = n;
+
+    l->tail = n;
+    l->size++;
+}
+
+//
+// Find the node for a key, or -1
+//
+int node_find(int key)
+{
+    for (int n = node_hash[key % NODE_HASH_BUCKETS]; n != -1; n = nodes[n].hash_next) {
+        if (nodes[n].key == key)
+            return n;
+    }
+
+    return -1;
+}
+
+//
+// Take a node from the free pool and hash it under key
+//
+int node_alloc(int key)
+{
+    int n = node_free;
+    int bucket = key % NODE_HASH_BUCKETS;
+
+    node_free = nodes[n].hash_next;
+
+    nodes[n].key = key;
+    nodes[n].entry = -1;
+    nodes[n].state = 0;
+    nodes[n].hash_next = node_hash[bucket];
+    node_hash[bucket] = n;
+
+    return n;
+}
+
+//
+// Unlink a node from every list and the hash map and return it to the pool
+//
+void node_release(int n)
+{
+    int *p = &node_hash[nodes[n].key % NODE_HASH_BUCKETS];
+
+    while (*p != n)
+        p = &nodes[*p].hash_next;
+    *p = nodes[n].hash_next;
+
+    list_unlink(0, n);
+    list_unlink(1, n);
+
+    if (nodes[n].entry != -1)
+        tlb[nodes[n].entry].node = -1;
+
+    nodes[n].key = -1;
+    nodes[n].hash_next = node_free;
+    node_free = n;
+}
+
+//
+// Forget every node
+//
+void repl_reset(void)
+{
+    node_free = -1;
+
+    for (int n = NODE_COUNT - 1; n >= 0; n--) {
+        nodes[n].key = -1;
+        nodes[n].hash_next = node_free;
+        node_free = n;
+
+        for (int set = 0; set < 2; set++)
+            links[set][n].list = -1;
+    }
+
+    for (int b = 0; b < NODE_HASH_BUCKETS; b++)
+        node_hash[b] = -1;
+
+    for (int l = 0; l < LIST_COUNT; l++) {
+        lists[l].head = lists[l].tail = -1;
+        lists[l].size = 0;
+    }
+
+    for (int i = 0; i < TLB_ENTRIES; i++)
+        tlb[i].node = -1;
+
+    arc_p = 0;
+    lirs_lir_count = 0;
+}
+
+//
+// Return a free TLB entry, or -1 if the TLB is full
+//
+int tlb_free_entry(void)
+{
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        if (tlb[i].asid == -1)
+            return i;
+    }
+
+    return -1;
+}
+
+//
+// Evict the resident node n and return the TLB entry it held
+//
+// If list isn't -1 the node stays as a ghost on that list of link set
+// set, keeping its place on lists of the other link set.
+//
+int evict_node(int n, int set, int list)
+{
+    int entry = nodes[n].entry;
+
+    tlb[entry].node = -1;
+    nodes[n].entry = -1;
+
+    if (list == -1)
+        node_release(n);
+    else
+        list_push(set, list, n);
+
+    return entry;
+}
+
+//
+// Give a new node for key the TLB entry at entry
+//
+int attach_node(int key, int entry)
+{
+    int n = node_alloc(key);
+
+    nodes[n].entry = entry;
+    tlb[entry].node = n;
+
+    return n;
+}
+
+//
+// 2Q
+//
+
+void twoq_hit(int n)
+{
+    if (links[0][n].list == LIST_B)
+        list_push(0, LIST_B, n);
+}
+
+int twoq_fill(int key, int activate)
+{
+    int ghost = node_find(key);
+    int entry = tlb_free_entry();
+
+    if (entry == -1) {
+        if (lists[LIST_A].size > TWOQ_KIN || lists[LIST_B].size == 0) {
+            entry = evict_node(lists[LIST_A].tail, 0, LIST_C);
+            if (lists[LIST_C].size > TWOQ_KOUT)
+                node_release(lists[LIST_C].tail);
+        } else {
+            entry = evict_node(lists[LIST_B].tail, 0, -1);
+        }
+    }
+
+    // The ghost may have just been trimmed from A1out
+    if (ghost != -1 && nodes[ghost].key == key && nodes[ghost].entry == -1) {
+        node_release(ghost);
+        ghost_hits++;
+        list_push(0, LIST_B, attach_node(key, entry));
+    } else if (activate) {
+        refault_activations++;
+        list_push(0, LIST_B, attach_node(key, entry));
+    } else {
+        list_push(0, LIST_A, attach_node(key, entry));
+    }
+
+    return entry;
+}
+
+//
+// ARC
+//
+
+void arc_hit(int n)
+{
+    list_push(0, LIST_B, n);
+}
+
+//
+// Evict from T1 or T2 towards the target size of T1 and return the entry
+//
+int arc_replace(int in_b2)
+{
+    int t1 = lists[LIST_A].size;
+
+    if (t1 > 0 && ((in_b2 && t1 == arc_p) || t1 > arc_p || lists[LIST_B].size == 0))
+        return evict_node(lists[LIST_A].tail, 0, LIST_C);
+
+    return evict_node(lists[LIST_B].tail, 0, LIST_D);
+}
+
+int arc_fill(int key)
+{
+    int n = node_find(key);
+    int entry = tlb_free_entry();
+    int b1 = lists[LIST_C].size;
+    int b2 = lists[LIST_D].size;
+
+    if (n != -1 && (links[0][n].list == LIST_C || links[0][n].list == LIST_D)) {
+        int in_b2 = links[0][n].list == LIST_D;
+
+        if (in_b2) {
+            arc_p -= b1 > b2? b1 / b2: 1;
+            if (arc_p < 0)
+                arc_p = 0;
+        } else {
+            arc_p += b2 > b1? b2 / b1: 1;
+            if (arc_p > TLB_ENTRIES)
+                arc_p = TLB_ENTRIES;
+        }
+
+        ghost_hits++;
+        node_release(n);
+
+        if (entry == -1)
+            entry = arc_replace(in_b2);
+
+        list_push(0, LIST_B, attach_node(key, entry));
+        return entry;
+    }
+
+    if (lists[LIST_A].size + b1 >= TLB_ENTRIES) {
+        if (b1 > 0) {
+            node_release(lists[LIST_C].tail);
+            if (entry == -1)
+                entry = arc_replace(0);
+        } else if (entry == -1) {
+            entry = evict_node(lists[LIST_A].tail, 0, -1);
+        }
+    } else {
+        if (lists[LIST_A].size + lists[LIST_B].size + b1 + b2 >= 2 * TLB_ENTRIES)
+            node_release(lists[LIST_D].tail);
+        if (entry == -1)
+            entry = arc_replace(0);
+    }
+
+    list_push(0, LIST_A, attach_node(key, entry));
+    return entry;
+}
+
+//
+// LIRS
+//
+
+//
+// Pop HIR nodes off the bottom of the stack until the bottom is LIR
+//
+void lirs_prune(void)
+{
+    int n;
+
+    while ((n = lists[LIST_A].tail) != -1 && nodes[n].state != LIRS_LIR) {
+        list_unlink(0, n);
+        if (nodes[n].state == LIRS_GHOST)
+            node_release(n);
+    }
+}
+
+//
+// Turn the LIR node at the bottom of the stack into a resident HIR node
+//
+void lirs_demote_bottom(void)
+{
+    int n = lists[LIST_A].tail;
+
+    nodes[n].state = LIRS_HIR;
+    lirs_lir_count--;
+    list_unlink(0, n);
+    list_append(1, LIST_B, n);
+    lirs_prune();
+}
+
+//
+// Make a node LIR at the top of the stack, demoting the bottom LIR node
+// if the LIR set is full
+//
+void lirs_promote(int n)
+{
+    nodes[n].state = LIRS_LIR;
+    lirs_lir_count++;
+    list_push(0, LIST_A, n);
+
+    if (lirs_lir_count > LIRS_LIR_MAX)
+        lirs_demote_bottom();
+}
+
+void lirs_hit(int n)
+{
+    if (nodes[n].state == LIRS_LIR) {
+        int bottom = lists[LIST_A].tail == n;
+        list_push(0, LIST_A, n);
+        if (bottom)
+            lirs_prune();
+    } else if (links[0][n].list == LIST_A || lirs_lir_count < LIRS_LIR_MAX) {
+        list_unlink(1, n);
+        lirs_promote(n);
+    } else {
+        list_push(0, LIST_A, n);
+        list_append(1, LIST_B, n);
+    }
+}
+
+int lirs_fill(int key)
+{
+    int ghost = node_find(key);
+    int entry = tlb_free_entry();
+
+    if (entry == -1) {
+        int victim = lists[LIST_B].head;
+
+        // Only LIR nodes left; fall back to the bottom of the stack
+        if (victim == -1) {
+            lirs_demote_bottom();
+            victim = lists[LIST_B].head;
+        }
+
+        // A victim still on the stack stays there as a non-resident ghost
+        if (links[0][victim].list == LIST_A) {
+            nodes[victim].state = LIRS_GHOST;
+            entry = evict_node(victim, 1, LIST_C);
+            if (lists[LIST_C].size > LIRS_GHOST_MAX)
+                node_release(lists[LIST_C].tail);
+        } else {
+            entry = evict_node(victim, 1, -1);
+        }
+    }
+
+    int n;
+
+    if (ghost != -1 && nodes[ghost].key == key && nodes[ghost].state == LIRS_GHOST) {
+        ghost_hits++;
+        node_release(ghost);
+        lirs_promote(attach_node(key, entry));
+        return entry;
+    }
+
+    n = attach_node(key, entry);
+
+    if (lirs_lir_count < LIRS_LIR_MAX) {
+        lirs_promote(n);
+    } else {
+        nodes[n].state = LIRS_HIR;
+        list_push(0, LIST_A, n);
+        list_append(1, LIST_B, n);
+    }
+
+    return entry;
+}
+
+//
+// LFU and LeCaR
+//
+
+void lfu_hit(int n)
+{
+    if (nodes[n].state < FREQ_MAX)
+        nodes[n].state++;
+
+    list_push(0, LIST_A, n);
+    list_push(1, LIST_FREQ + nodes[n].state, n);
+}
+
+//
+// Return the least frequently used resident node, least recent first
+//
+int lfu_victim(void)
+{
+    for (int f = 1; f <= FREQ_MAX; f++) {
+        if (lists[LIST_FREQ + f].tail != -1)
+            return lists[LIST_FREQ + f].tail;
+    }
+
+    return -1;
+}
+
+//
+// Reward the expert that didn't evict a key that has just missed again
+//
+// The regret decays with how long ago the eviction was.
+//
+void lecar_regret(int n)
+{
+    double age = tlb_clock - nodes[n].stamp;
+    double discount = pow(LECAR_DISCOUNT_BASE, 1.0 / TLB_ENTRIES);
+    double reward = exp(LECAR_RATE * pow(discount, age));
+    double w_lru = lecar_w_lru;
+    double w_lfu = 1 - lecar_w_lru;
+
+    if (links[0][n].list == LIST_C)
+        w_lfu *= reward;
+    else
+        w_lru *= reward;
+
+    lecar_w_lru = w_lru / (w_lru + w_lfu);
+}
+
+int lfu_fill(int key)
+{
+    int ghost = node_find(key);
+    int entry = tlb_free_entry();
+
+    if (tlb_policy == POLICY_LECAR && ghost != -1 && nodes[ghost].entry == -1) {
+        lecar_regret(ghost);
+        ghost_hits++;
+        node_release(ghost);
+    }
+
+    if (entry == -1) {
+        int victim;
+        int history = -1;
+
+        if (tlb_policy == POLICY_LFU) {
+            victim = lfu_victim();
+        } else if ((double)rand() / RAND_MAX < lecar_w_lru) {
+            victim = lists[LIST_A].tail;
+            history = LIST_C;
+        } else {
+            victim = lfu_victim();
+            history = LIST_D;
+        }
+
+        list_unlink(1, victim);
+        nodes[victim].stamp = tlb_clock;
+        entry = evict_node(victim, 0, history);
+
+        if (history != -1 && lists[history].size > TLB_ENTRIES)
+            node_release(lists[history].tail);
+    }
+
+    int n = attach_node(key, entry);
+    nodes[n].state = 1;
+    list_push(0, LIST_A, n);
+    list_push(1, LIST_FREQ + 1, n);
+
+    return entry;
+}
+
+//
+// Advance the TLB clock by one access, sampling the LeCaR weights
+//
+void tlb_tick(void)
+{
+    tlb_clock++;
+
+    if (tlb_policy == POLICY_LECAR && tlb_clock % LECAR_SAMPLE_INTERVAL == 0
+            && lecar_sample_count < LECAR_SAMPLES)
+        lecar_samples[lecar_sample_count++] = lecar_w_lru;
+}
+
+//
+// Note a TLB hit on an entry
+//
+void repl_hit(int entry)
+{
+    int n = tlb[entry].node;
+
+    tlb_tick();
+
+    if (tlb_policy == POLICY_LRU)
+        tlb[entry].last_use = tlb_clock;
+    else if (tlb_policy == POLICY_2Q)
+        twoq_hit(n);
+    else if (tlb_policy == POLICY_ARC)
+        arc_hit(n);
+    else if (tlb_policy == POLICY_LIRS)
+        lirs_hit(n);
+    else
+        lfu_hit(n);
+}
+
+//
+// Pick the TLB entry a new key goes into, evicting if the TLB is full
+//
+// activate asks for the key to go straight onto the active list, for
+// policies that have one (2Q's Am).
+//
+int repl_fill(int key, int activate)
+{
+    int entry;
+
+    tlb_tick();
+
+    if (tlb_policy == POLICY_2Q)
+        return twoq_fill(key, activate);
+    if (tlb_policy == POLICY_ARC)
+        return arc_fill(key);
+    if (tlb_policy == POLICY_LIRS)
+        return lirs_fill(key);
+    if (tlb_policy == POLICY_LFU || tlb_policy == POLICY_LECAR)
+        return lfu_fill(key);
+
+    entry = tlb_free_entry();
+    if (entry == -1) {
+        entry = 0;
+        for (int i = 1; i < TLB_ENTRIES; i++) {
+            if (tlb[i].last_use < tlb[entry].last_use)
+                entry = i;
+        }
+    }
+
+    tlb[entry].last_use = tlb_clock;
+    return entry;
+}
+
+//
+// Drop an invalidated TLB entry's node without leaving a ghost
+//
+void repl_forget(int entry)
+{
+    int n = tlb[entry].node;
+
+    if (n == -1)
+        return;
+
+    if (tlb_policy == POLICY_LIRS && nodes[n].state == LIRS_LIR) {
+        lirs_lir_count--;
+        node_release(n);
+        lirs_prune();
+    } else {
+        node_release(n);
+    }
+}
+
+//
+// Flush the whole TLB
+//
+// Ghost history goes too; its ASIDs may be handed out again.
+//
+void tlb_flush(void)
+{
+    for (int i = 0; i < TLB_ENTRIES; i++)
+        tlb[i].asid = -1;
+
+    repl_reset();
+}
+
+//
+// Remove every device mapping of a page, along with its IOTLB entries,
+// queued lazy unmaps and the pins they hold
+//
+void iommu_detach_page(int page)
+{
+    for (int dev = 0; dev < DEV_COUNT; dev++) {
+        int len = 0;
+
+        for (int io_page = 0; io_page < PAGE_COUNT; io_page++) {
+            if (io_page_table[dev][io_page] == page) {
+                io_page_table[dev][io_page] = 0;
+                io_pin_count[page]--;
+            }
+        }
+
+        for (int i = 0; i < IOTLB_ENTRIES; i++) {
+            if (iotlb[dev][i].io_page != -1 && iotlb[dev][i].page == page) {
+                iotlb[dev][i].io_page = -1;
+                iotlb_invalidations++;
+            }
+        }
+
+        for (int i = 0; i < flush_queue_len[dev]; i++) {
+            if (flush_queue[dev][i].page == page)
+                io_pin_count[page]--;
+            else
+                flush_queue[dev][len++] = flush_queue[dev][i];
+        }
+        flush_queue_len[dev] = len;
+    }
+}
+
+//
+// Free a page from an unmapped process, deferring it in lazy TLB mode
+//
+// Devices lose access right away, so DMA can't reach a deferred page or
+// its next owner.
+//
+void release_page(int page)
+{
+    iommu_detach_page(page);
+
+    if (!lazy_tlb) {
+        free_page(page);
+        return;
+    }
+
+    deferred_pages[deferred_count++] = page;
+    if (deferred_count > deferred_peak)
+        deferred_peak = deferred_count;
+}
+
+//
+// Pass a flush epoch, releasing every deferred page
+//
+// Deferred pages belong to killed processes whose ASIDs are never handed
+// out again before a rollover flush, so no TLB entry can reach them.
+//
+void tlb_epoch(void)
+{
+    for (int i = 0; i < deferred_count; i++)
+        free_page(deferred_pages[i]);
+
+    deferred_count = 0;
+    flush_epochs++;
+}
+
+//
+// Return the ASID a process's TLB entries are tagged with, or -1 if it
+// can't have any
+//
+int tlb_asid(int proc_num)
+{
+    if (asid_bits == 0)
+        return proc_num == current_proc? 0: -1;
+
+    return proc_asid_gen[proc_num] == asid_generation? proc_asid[proc_num]: -1;
+}
+
+//
+// Switch to a process, assigning it an ASID if it has none in the current
+// generation
+//
+// ASID 0 is never handed out. When the ASID space runs out a new
+// generation starts: the TLB is flushed once and ASIDs are reassigned as
+// processes are switched back in.
+//
+void switch_to(int proc_num)
+{
+    if (proc_num == current_proc)
+        return;
+
+    current_proc = proc_num;
+    context_switches++;
+
+    if (deferred_count > 0)
+        tlb_epoch();
+
+    // Only flushes forced by switching count towards tlb_flushes, not
+    // those from reconfiguring the TLB
+    if (asid_bits == 0) {
+        tlb_flush();
+        tlb_flushes++;
+        return;
+    }
+
+    if (proc_asid_gen[proc_num] == asid_generation)
+        return;
+
+    if (next_asid == 1 << asid_bits) {
+        asid_generation++;
+        asid_rollovers++;
+        next_asid = 1;
+        tlb_flush();
+        tlb_flushes++;
+    }
+
+    proc_asid[proc_num] = next_asid++;
+    proc_asid_gen[proc_num] = asid_generation;
+}
+
+//
+// Select the TLB replacement policy by name
+//
+// The TLB is flushed since the policies don't share state.
+//
+void set_tlb_policy(char *name)
+{
+    if (strcmp(name, "lru") == 0)
+        tlb_policy = POLICY_LRU;
+    else if (strcmp(name, "2q") == 0)
+        tlb_policy = POLICY_2Q;
+    else if (strcmp(name, "arc") == 0)
+        tlb_policy = POLICY_ARC;
+    else if (strcmp(name, "lirs") == 0)
+        tlb_policy = POLICY_LIRS;
+    else if (strcmp(name, "lfu") == 0)
+        tlb_policy = POLICY_LFU;
+    else if (strcmp(name, "lecar") == 0)
+        tlb_policy = POLICY_LECAR;
+    else {
+        printf("Error: Unknown TLB policy %s\n", name);
+        return;
+    }
+
+    lecar_w_lru = 0.5;
+    lecar_sample_count = 0;
+    tlb_flush();
+}
+
+//
+// Change the ASID width
+//
+// Existing ASIDs may not fit, so this starts a new generation.
+//
+void set_asid_bits(int bits)
+{
+    if (bits < 0 || bits > 16) {
+        printf("Error: ASID width must be 0-16 bits\n");
+        return;
+    }
+
+    asid_bits = bits;
+    asid_generation++;
+    next_asid = 1;
+    current_proc = -1;
+    tlb_flush();
+}
+
+//
+// Look up a virtual page in the TLB
+//
+// Returns the physical page, or -1 on a miss.
+//
+int tlb_lookup(int proc_num, int virtual_page)
+{
+    int asid = tlb_asid(proc_num);
+
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        struct tlb_entry *e = &tlb[i];
+        if (asid != -1 && e->asid == asid && virtual_page >= e->vpage
+                && virtual_page < e->vpage + e->count) {
+            repl_hit(i);
+            return e->page + virtual_page - e->vpage;
+        }
+    }
+
+    return -1;
+}
+
+//
+// Insert a translation into the TLB, replacing an entry chosen by the
+// replacement policy if it's full
+//
+// If the page's PTE group carries the contiguous hint the entry covers
+// the whole group.
+//
+void tlb_fill(int proc_num, int virtual_page, int page)
+{
+    int asid = tlb_asid(proc_num);
+    int slot = 0;
+    int count = 1;
+
+    if (contig_hint[proc_num][virtual_page / CONTIG_PAGES]) {
+        slot = virtual_page % CONTIG_PAGES;
+        count = CONTIG_PAGES;
+        tlb_contig_fills++;
+    }
+
+    // A refault close enough that the page would have stayed cached with
+    // an active list this much larger is thrashing; promote it directly
+    int *shadow = &tlb_shadow[proc_num][virtual_page - slot];
+    int activate = 0;
+
+    if (*shadow != 0) {
+        int active = tlb_policy == POLICY_2Q? TLB_ENTRIES - TWOQ_KIN: TLB_ENTRIES;
+
+        refaults++;
+        if (tlb_evictions - *shadow < active) {
+            thrash_refaults++;
+            activate = 1;
+        }
+        *shadow = 0;
+    }
+
+    struct tlb_entry *victim = &tlb[repl_fill(repl_key(asid, virtual_page - slot), activate)];
+
+    if (victim->asid != -1) {
+        tlb_evictions++;
+
+        // Stale entries of a dead or re-tagged process leave no shadow
+        if (tlb_asid(victim->proc) == victim->asid)
+            tlb_shadow[victim->proc][victim->vpage] = tlb_evictions;
+    }
+
+    victim->asid = asid;
+    victim->proc = proc_num;
+    victim->vpage = virtual_page - slot;
+    victim->page = page - slot;
+    victim->count = count;
+}
+
+//
+// Invalidate TLB entries of a process covering a virtual page, or all of
+// the process's entries if virtual_page is -1
+//
+void tlb_invalidate(int proc_num, int virtual_page)
+{
+    int asid = tlb_asid(proc_num);
+
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        struct tlb_entry *e = &tlb[i];
+        if (asid != -1 && e->asid == asid && (virtual_page == -1
+                || (virtual_page >= e->vpage && virtual_page < e->vpage + e->count))) {
+            repl_forget(i);
+            e->asid = -1;
+        }
+    }
+}
+
+//
+// Set the contiguous hint on every PTE group of a process that qualifies
+//
+void update_contig_hints(int proc_num)
+{
+    int pt_addr = get_address(get_page_table(proc_num), 0);
+
+    for (int g = 0; g < CONTIG_GROUPS; g++) {
+        int first = mem[pt_addr + g * CONTIG_PAGES];
+        int contig = first != 0 && first % CONTIG_PAGES == 0;
+
+        for (int i = 1; i < CONTIG_PAGES && contig; i++)
+            contig = mem[pt_addr + g * CONTIG_PAGES + i] == first + i;
+
+        contig_hint[proc_num][g] = contig;
+    }
+}
+
+//
+// Release the unused pages of a reservation
+//
+void break_reservation(int block)
+{
+    for (int i = 0; i < LARGE_PAGE_PAGES; i++) {
+        int page = block * LARGE_PAGE_PAGES + i;
+        if (reserved[page]) {
+            reserved[page] = 0;
+            free_page(page);
+        }
+    }
+
+    reservations[block].proc = -1;
+}
+
+//
+// Break reservations, least recently made first, until need pages have
+// been released or there are none left
+//
+void break_reservations(int need)
+{
+    while (need > 0) {
+        int oldest = -1;
+
+        for (int b = 0; b < PAGE_COUNT / LARGE_PAGE_PAGES; b++) {
+            if (reservations[b].proc != -1
+                    && (oldest == -1 || reservations[b].seq < reservations[oldest].seq))
+                oldest = b;
+        }
+
+        if (oldest == -1)
+            return;
+
+        need -= LARGE_PAGE_PAGES - reservations[oldest].used;
+        break_reservation(oldest);
+        reservations_broken++;
+    }
+}
+
+//
+// Under pressure, give back deferred and then reserved but unused pages
+// until tables page table pages and data data pages fit, if they can
+//
+void reclaim_pages(int tables, int data)
+{
+    if (pages_short(tables, data) > 0 && deferred_count > 0)
+        tlb_epoch();
+    if (pages_short(tables, data) > 0)
+        break_reservations(pages_short(tables, data));
+}
+
+//
+// Allocate the page for virtual page vpage of a process from a superpage
+// reservation
+//
+// The first page in a large-page region reserves a whole aligned free
+// block, as long as that leaves enough free pages for the remaining pages
+// outside the region. Later pages of the region fill the block in place.
+// When the block is full it is promoted to a range translation.
+//
+// Falls back to alloc_page() if there's no reservation to use.
+//
+int alloc_reserved_page(int proc_num, int vpage, int remaining)
+{
+    int vregion = vpage / LARGE_PAGE_PAGES;
+    int slot = vpage % LARGE_PAGE_PAGES;
+    int block = -1;
+
+    for (int b = 0; b < PAGE_COUNT / LARGE_PAGE_PAGES && block == -1; b++) {
+        if (reservations[b].proc == proc_num && reservations[b].vregion == vregion)
+            block = b;
+    }
+
+    if (block == -1) {
+        int in_region = LARGE_PAGE_PAGES - slot;
+        if (in_region > remaining)
+            in_region = remaining;
+
+        int first = pt_region? PT_REGION_PAGES / LARGE_PAGE_PAGES: 0;
+        for (int b = first; b < PAGEBLOCK_COUNT && block == -1; b++) {
+            if (pageblock_free_pages(b) == LARGE_PAGE_PAGES
+                    && pages_short(0, remaining - in_region + LARGE_PAGE_PAGES) == 0)
+                block = b;
+        }
+
+        if (block == -1)
+            return alloc_page(MT_MOVABLE);
+
+        for (int i = 0; i < LARGE_PAGE_PAGES; i++) {
+            take_page(block * LARGE_PAGE_PAGES + i, MT_MOVABLE);
+            reserved[block * LARGE_PAGE_PAGES + i] = 1;
+        }
+
+        reservations[block].proc = proc_num;
+        reservations[block].vregion = vregion;
+        reservations[block].used = 0;
+        reservations[block].seq = ++reservation_seq;
+        reservations_made++;
+    }
+
+    int page = block * LARGE_PAGE_PAGES + slot;
+    reserved[page] = 0;
+
+    if (++reservations[block].used == LARGE_PAGE_PAGES) {
+        promotions++;
+        reservations[block].proc = -1;
+
+        if (range_count[proc_num] < MAX_RANGES) {
+            struct range *r = &ranges[proc_num][range_count[proc_num]++];
+            r->vpage = vregion * LARGE_PAGE_PAGES;
+            r->count = LARGE_PAGE_PAGES;
+            r->page = block * LARGE_PAGE_PAGES;
+        }
+    }
+
+    return page;
+}
+
+//
+// Allocate pages for a new process
+//
+// This includes the new process page table and page_count data pages.
+// All of them are accounted for up front, so a process that can't fit is
+// rejected before any page is allocated.
+//
+void new_process(int proc_num, int page_count) {
+    if (!valid_proc(proc_num))
+        return;
+
+    reclaim_pages(1, page_count);
+
+    if (free_pages < 1) {
+        printf("OOM: proc %d: page table\n", proc_num);
+        return;
+    }
+
+    if (pages_short(1, page_count) > 0) {
+        printf("OOM: proc %d: data page\n", proc_num);
+        return;
+    }
+
+    // Allocate a single page for this process's page table
+    int pt_page = alloc_page(MT_UNMOVABLE);
+    if (pt_page == -1) {
+        printf("OOM: proc %d: page table\n", proc_num);
+        return;
+    }
+
+    // Allocate the data pages the process requested
+    int data_pages[PAGE_COUNT];
+    int j = 0;
+
+    range_count[proc_num] = 0;
+
+    // In eager mode, take the largest free runs first and record each as a
+    // range translation
+    while (eager && j < page_count && range_count[proc_num] < MAX_RANGES) {
+        int first = pt_region? PT_REGION_PAGES: 0;
+        int start = -1;
+        int len = 0;
+
+        for (int i = free_map_find(first, online_pages); i != -1;) {
+            int run = free_map_run(i, online_pages);
+            if (run > len) {
+                start = i;
+                len = run;
+            }
+            i = free_map_find(i + run, online_pages);
+        }
+
+        if (start == -1)
+            break;
+        if (len > page_count - j)
+            len = page_count - j;
+
+        struct range *r = &ranges[proc_num][range_count[proc_num]++];
+        r->vpage = j;
+        r->count = len;
+        r->page = start;
+
+        for (int i = 0; i < len; i++) {
+            take_page(start + i, MT_MOVABLE);
+            data_pages[j++] = start + i;
+        }
+    }
+
+    for (; j < page_count; j++) {
+        if (reserve)
+            data_pages[j] = alloc_reserved_page(proc_num, j, page_count - j);
+        else
+            data_pages[j] = alloc_page(MT_MOVABLE);
+
+        // Not expected after the checks above; leave the rest unmapped
+        if (data_pages[j] == -1) {
+            printf("OOM: proc %d: data page\n", proc_num);
+            break;
+        }
+    }
+
+    // Set the page table pointer
+    set_page_table(proc_num, pt_page);
+
+    // Set the page table entries
+    for (int i = 0; i < j; i++)
+        set_pte(pt_page, i, data_pages[i]);
+
+    update_contig_hints(proc_num);
+
+    // A fresh ASID on first switch-in; the old one's entries are never hit
+    tlb_invalidate(proc_num, -1);
+    proc_asid_gen[proc_num] = 0;
+    if (current_proc == proc_num)
+        current_proc = -1;
+}
+
+//
+// Free a process's page table, data pages and direct segment, leaving its
+// TLB entries and ASID to the caller
+//
+// Returns -1 if there is no such process.
+//
+int free_process(int proc_num)
+{
+    if (!valid_proc(proc_num))
+        return -1;
+
+    int pt_page = get_page_table(proc_num);
+
+    // Page 0 is never a page table, so this process doesn't exist
+    if (pt_page == 0) {
+        printf("Error: No such process %d\n", proc_num);
+        return -1;
+    }
+
+    // Free the data pages
+    int pt_addr = get_address(pt_page, 0);
+    for (int i = 0; i < PAGE_COUNT; i++) {
+        int data_page = mem[pt_addr + i];
+        if (data_page != 0) {
+            release_page(data_page);
+        }
+    }
+
+    // Release any reservations still open for the process
+    for (int b = 0; b < PAGE_COUNT / LARGE_PAGE_PAGES; b++) {
+        if (reservations[b].proc == proc_num)
+            break_reservation(b);
+    }
+
+    // Free the direct segment
+    struct segment *seg = &segments[proc_num];
+    for (int i = 0; i < seg->limit - seg->base; i++)
+        release_page(seg->offset + i);
+    seg->limit = 0;
+
+    // Free the page table
+    release_page(pt_page);
+
+    // Free the page table pointer
+    set_page_table(proc_num, 0);
+    proc_group[proc_num] = -1;
+    range_count[proc_num] = 0;
+    memset(contig_hint[proc_num], 0, sizeof(contig_hint[proc_num]));
+    memset(tlb_shadow[proc_num], 0, sizeof(tlb_shadow[proc_num]));
+
+    return 0;
+}
+
+//
+// Forget a killed process's ASID, after its TLB entries are gone or
+// deferred
+//
+void drop_asid(int proc_num)
+{
+    proc_asid_gen[proc_num] = 0;
+    if (current_proc == proc_num)
+        current_proc = -1;
+}
+
+//
+// Kill a process
+//
+// This includes freeing the process's page table and data pages.
+void kill_process(int proc_num) {
+    if (free_process(proc_num) == -1)
+        return;
+
+    if (lazy_tlb) {
+        shootdowns_avoided++;
+    } else {
+        tlb_invalidate(proc_num, -1);
+        tlb_shootdowns++;
+    }
+
+    drop_asid(proc_num);
+}
+
+//
+// Create a process with page_count paged data pages followed by a direct
+// segment of seg_pages physically contiguous pages
+//
+// The segment has no PTEs; it is translated by base/limit/offset alone.
+//
+void new_process_segment(int proc_num, int page_count, int seg_pages)
+{
+    if (!valid_proc(proc_num))
+        return;
+
+    if (page_count + seg_pages > PAGE_COUNT) {
+        printf("Error: proc %d: address space too large\n", proc_num);
+        return;
+    }
+
+    reclaim_pages(1, page_count + seg_pages);
+
+    if (pages_short(1, page_count + seg_pages) > 0) {
+        printf("OOM: proc %d: data page\n", proc_num);
+        return;
+    }
+
+    int first = pt_region? PT_REGION_PAGES: 0;
+    int start = free_map_find(first, online_pages);
+
+    while (start != -1 && free_map_run(start, online_pages) < seg_pages)
+        start = free_map_find(start + free_map_run(start, online_pages), online_pages);
+
+    if (start == -1) {
+        printf("OOM: proc %d: direct segment\n", proc_num);
+        return;
+    }
+
+    for (int i = 0; i < seg_pages; i++)
+        take_page(start + i, MT_UNMOVABLE);
+
+    new_process(proc_num, page_count);
+
+    segments[proc_num].base = page_count;
+    segments[proc_num].limit = page_count + seg_pages;
+    segments[proc_num].offset = start;
+}
+
+//
+// Return 1 if a page backs any process's direct segment
+//
+int in_direct_segment(int page)
+{
+    for (int p = 0; p < MAX_PROCS; p++) {
+        struct segment *seg = &segments[p];
+        if (page >= seg->offset && page < seg->offset + seg->limit - seg->base)
+            return 1;
+    }
+
+    return 0;
+}
+
+//
+// Create count processes of page_count data pages each in a group
+//
+// The processes get the lowest unused process numbers. The whole group is
+// accounted for up front, so either every process is created or none is.
+//
+void new_process_group(int group, int count, int page_count)
+{
+    int procs[MAX_PROCS];
+    int found = 0;
+
+    // -1 in proc_group means no group
+    if (group < 0) {
+        printf("Error: Invalid group %d\n", group);
+        return;
+    }
+
+    if (count < 0) {
+        printf("Error: Invalid process count %d\n", count);
+        return;
+    }
+
+    for (int p = 0; p < MAX_PROCS && found < count; p++) {
+        if (get_page_table(p) == 0)
+            procs[found++] = p;
+    }
+
+    if (found < count) {
+        printf("Error: group %d: out of process numbers\n", group);
+        return;
+    }
+
+    reclaim_pages(count, count * page_count);
+
+    if (pages_short(count, count * page_count) > 0) {
+        printf("OOM: group %d\n", group);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        new_process(procs[i], page_count);
+        proc_group[procs[i]] = group;
+    }
+
+    printf("New group %d: %d procs", group, count);
+    for (int i = 0; i < count; i++)
+        printf("%s%d", i == 0? ": ": " ", procs[i]);
+    putchar('\n');
+}
+
+//
+// Kill every process in a group
+//
+void kill_process_group(int group)
+{
+    int procs[MAX_PROCS];
+    int count = 0;
+
+    if (group < 0) {
+        printf("Error: Invalid group %d\n", group);
+        return;
+    }
+
+    for (int p = 0; p < MAX_PROCS; p++) {
+        if (proc_group[p] == group) {
+            free_process(p);
+            procs[count++] = p;
+        }
+    }
+
+    // One flush covers the whole group instead of a shootdown per process
+    if (count > 0) {
+        if (lazy_tlb) {
+            shootdowns_avoided++;
+        } else {
+            tlb_flush();
+            tlb_shootdowns++;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+        drop_asid(procs[i]);
+
+    printf("Kill group %d: %d procs\n", group, count);
+}
+
+//
+// Drop any range translation of a process that covers a virtual page
+//
+void drop_range(int proc_num, int virtual_page)
+{
+    for (int i = 0; i < range_count[proc_num]; i++) {
+        struct range *r = &ranges[proc_num][i];
+        if (virtual_page >= r->vpage && virtual_page < r->vpage + r->count) {
+            *r = ranges[proc_num][--range_count[proc_num]];
+            return;
+        }
+    }
+}
+
+//
+// Move an allocated page to a free page below limit
+//
+// The page table pointer or page table entry that refers to the page is
+// updated to the new location. Returns 0 on success, -1 if there is no
+// free page to move to.
+//
+int migrate_page(int page, int limit)
+{
+    int saved_online = online_pages;
+    online_pages = limit;
+    int new_page = alloc_page(page_type[page]);
+    online_pages = saved_online;
+
+    if (new_page == -1)
+        return -1;
+
+    memcpy(mem + get_address(new_page, 0), mem + get_address(page, 0), PAGE_SIZE);
+
+    for (int i = 0; i < balloon_size; i++) {
+        if (balloon_pages[i] == page)
+            balloon_pages[i] = new_page;
+    }
+
+    for (int p = 0; p < MAX_PROCS; p++) {
+        int pt_page = get_page_table(p);
+
+        if (pt_page == 0)
+            continue;
+
+        if (pt_page == page) {
+            set_page_table(p, new_page);
+            break;
+        }
+
+        int pt_addr = get_address(pt_page, 0);
+        for (int i = 0; i < PAGE_COUNT; i++) {
+            if (mem[pt_addr + i] == page) {
+                set_pte(pt_page, i, new_page);
+                drop_range(p, i);
+                contig_hint[p][i / CONTIG_PAGES] = 0;
+                tlb_invalidate(p, i);
+            }
+        }
+    }
+
+    free_page(page);
+
+    return 0;
+}
+
+//
+// Hot-add the lowest offline section
+//
+// Memory can't grow past PAGE_COUNT pages, the most one-byte PTEs can
+// name here, so only sections offline at boot (see BOOT_PAGES) or taken
+// offline by memremove can be added.
+//
+void mem_add(void)
+{
+    if (online_pages == PAGE_COUNT) {
+        printf("memadd: no offline sections\n");
+        return;
+    }
+
+    free_map_set(online_pages, online_pages + SECTION_PAGES, 0);
+
+    printf("memadd: pages %d-%d online\n", online_pages,
+        online_pages + SECTION_PAGES - 1);
+
+    if (online_pages < free_hint)
+        free_hint = online_pages;
+
+    online_pages += SECTION_PAGES;
+    free_pages += SECTION_PAGES;
+}
+
 //
-// Convert a page,offset into an address
+// Hot-remove the highest online section
 //
-int get_address(int page, int offset)
+// Allocated pages in the section are migrated to lower sections first.
+// Offline pages stay marked allocated so nothing else hands them out.
+//
+void mem_remove(void)
 {
-    return (page << PAGE_SHIFT) | offset;
+    int first = online_pages - SECTION_PAGES;
+
+    if (deferred_count > 0)
+        tlb_epoch();
+
+    if (first <= 0) {
+        printf("memremove: cannot remove the last section\n");
+        return;
+    }
+
+    // Make sure everything in the section can move and fits below it
+    // before moving anything. Reserved but unused pages aren't mapped by
+    // anyone, so they count as free. Only page tables may move into the
+    // page table region.
+    int used = 0;
+    int data = 0;
+    int unmovable = 0;
+    for (int i = first; i < online_pages; i++) {
+        if (mem[get_address(0, i)] == 0 || reserved[i])
+            continue;
+        used++;
+        data += page_type[i] != MT_UNMOVABLE;
+        unmovable += pin_count[i] != 0 || io_pin_count[i] != 0
+            || in_direct_segment(i);
+    }
+
+    int free_below = free_map_count(0, first);
+    int data_free_below = pt_region? free_map_count(PT_REGION_PAGES, first): free_below;
+
+    if (unmovable > 0) {
+        printf("memremove: pages %d-%d: %d unmovable\n", first,
+            online_pages - 1, unmovable);
+        return;
+    }
+
+    if (used > free_below || data > data_free_below) {
+        printf("memremove: pages %d-%d busy\n", first, online_pages - 1);
+        return;
+    }
+
+    for (int b = first / LARGE_PAGE_PAGES; b < online_pages / LARGE_PAGE_PAGES; b++) {
+        if (reservations[b].proc != -1) {
+            break_reservation(b);
+            reservations_broken++;
+        }
+    }
+
+    for (int i = first; i < online_pages; i++) {
+        if (mem[get_address(0, i)] != 0 && migrate_page(i, first) == -1) {
+            printf("memremove: pages %d-%d: page %d can't move\n", first,
+                online_pages - 1, i);
+            return;
+        }
+    }
+
+    free_map_set(first, online_pages, 1); // Mark pages as offline
+
+    printf("memremove: pages %d-%d offline\n", first, online_pages - 1);
+
+    online_pages = first;
+    free_pages -= SECTION_PAGES;
 }
 
 //
-// Initialize RAM
+// Inflate or deflate the balloon to target pages
 //
-void initialize_mem(void)
+// Inflating takes free pages away from the guest; deflating gives them
+// back. Deferred pages and unused reservations are reclaimed first; if
+// the guest still runs out of free pages the balloon stops short.
+//
+void set_balloon(int target)
 {
-    memset(mem, 0, MEM_SIZE);
+    while (balloon_size > target && balloon_size > 0)
+        free_page(balloon_pages[--balloon_size]);
 
-    int zpfree_addr = get_address(0, 0);
-    mem[zpfree_addr] = 1;  // Mark zero page as allocated
+    reclaim_pages(0, target - balloon_size);
+
+    while (balloon_size < target) {
+        int page = alloc_page(MT_RECLAIMABLE);
+        if (page == -1)
+            break;
+        balloon_pages[balloon_size++] = page;
+    }
+
+    printf("balloon: %d pages (target %d)\n", balloon_size, target);
 }
 
 //
-// Get the page table page for a given process
+// Return the physical page behind a process virtual page, or -1
 //
-unsigned char get_page_table(int proc_num)
+// Unlike virtual_to_physical(), this doesn't switch to the process, touch
+// the TLB or count anything, so control-plane commands can use it. Range
+// translations need no check: their pages all have PTEs too.
+//
+int walk_page(int proc_num, int virtual_page)
 {
-    int ptp_addr = get_address(0, PTP_OFFSET + proc_num);
-    return mem[ptp_addr];
+    if (proc_num < 0 || proc_num >= MAX_PROCS)
+        return -1;
+
+    int pt_page = get_page_table(proc_num);
+    if (pt_page == 0 || virtual_page < 0 || virtual_page >= PAGE_COUNT)
+        return -1;
+
+    struct segment *seg = &segments[proc_num];
+    if (virtual_page >= seg->base && virtual_page < seg->limit)
+        return seg->offset + virtual_page - seg->base;
+
+    int page = mem[get_address(pt_page, virtual_page)];
+    return page != 0? page: -1;
 }
 
 //
-// Allocate pages for a new process
+// Translate a process virtual address to a physical address
 //
-// This includes the new process page table and page_count data pages.
+// Returns -1 if the virtual page is out of range or not mapped.
 //
-void new_process(int proc_num, int page_count) {
-    int pt_page = -1;
+int virtual_to_physical(int proc_num, int vaddr)
+{
+    if (proc_num < 0 || proc_num >= MAX_PROCS)
+        return -1;
 
-    // Allocate a single page for this process's page table
-    for (int i = 0; i < PAGE_COUNT; i++) {
-        int addr = get_address(0, i);
-        if (mem[addr] == 0) { // Page is free
-            pt_page = i;
-            mem[addr] = 1; // Mark page as allocated
-            break;
-        }
+    unsigned char pt_page = get_page_table(proc_num);
+    int virtual_page = vaddr >> PAGE_SHIFT;
+    if (pt_page == 0 || vaddr < 0 || virtual_page >= PAGE_COUNT)
+        return -1;
+    int offset = vaddr & OFFSET_MASK;
+
+    switch_to(proc_num);
+
+    struct segment *seg = &segments[proc_num];
+    if (virtual_page >= seg->base && virtual_page < seg->limit) {
+        segment_hits++;
+        return get_address(seg->offset + virtual_page - seg->base, offset);
     }
 
-    if (pt_page == -1) {
-        printf("OOM: proc %d: page table\n", proc_num);
-        return;
+    int phys_page = tlb_lookup(proc_num, virtual_page);
+    if (phys_page != -1) {
+        tlb_hits++;
+        return get_address(phys_page, offset);
     }
 
-    // Allocate the data pages the process requested
-    int data_pages[page_count];
-    memset(data_pages, -1, sizeof(data_pages)); // Initialize data_pages with -1
+    tlb_misses++;
 
-    for (int j = 0; j < page_count; j++) {
-        int allocated = -1;
-        for (int i = 0; i < PAGE_COUNT; i++) {
-            int addr = get_address(0, i);
-            if (mem[addr] == 0) { // Page is free
-                allocated = i;
-                mem[addr] = 1; // Mark page as allocated
-                data_pages[j] = allocated;
-                break;
-            }
+    for (int i = 0; i < range_count[proc_num] && phys_page == -1; i++) {
+        struct range *r = &ranges[proc_num][i];
+        if (virtual_page >= r->vpage && virtual_page < r->vpage + r->count) {
+            range_hits++;
+            phys_page = r->page + virtual_page - r->vpage;
         }
+    }
 
-        if (allocated == -1) { // Check after trying to allocate each data page
-            printf("OOM: proc %d: data page\n", proc_num);
-            return; // Exiting the function if OOM occurs
-        }
+    if (phys_page == -1) {
+        page_walks++;
+        int pt_addr = get_address(pt_page, virtual_page);
+        phys_page = mem[pt_addr];
+        if (phys_page == 0)
+            return -1;
     }
 
-    // Set the page table pointer
-    int ptp_addr = get_address(0, PTP_OFFSET + proc_num);
-    mem[ptp_addr] = pt_page;
+    tlb_fill(proc_num, virtual_page, phys_page);
 
-    // Set the page table entries
-    int pt_addr = get_address(pt_page, 0);
-    for (int i = 0; i < page_count; i++) {
-        if (data_pages[i] != -1) { // Ensure the page was allocated
-            mem[pt_addr + i] = data_pages[i];
-        }
-    }
+    return get_address(phys_page, offset);
 }
 
 //
-// Kill a process
+// Pin or unpin the pages backing len bytes at vaddr
 //
-// This includes freeing the process's page table and data pages.
-void kill_process(int proc_num) {
-    int pt_page = get_page_table(proc_num);
+// delta is 1 to pin, -1 to unpin.
+//
+void pin_range(int proc_num, int vaddr, int len, int delta)
+{
+    if (len <= 0 || len > MEM_SIZE) {
+        printf("Error: Invalid length\n");
+        return;
+    }
 
-    // Free the data pages
-    int pt_addr = get_address(pt_page, 0);
-    for (int i = 0; i < PAGE_COUNT; i++) {
-        int data_page = mem[pt_addr + i];
-        if (data_page != 0) {
-            mem[get_address(0, data_page)] = 0; // Mark page as free
-        }
+    if (vaddr < 0 || vaddr >= MEM_SIZE) {
+        printf("Error: Invalid virtual address\n");
+        return;
     }
 
-    // Free the page table
-    mem[get_address(0, pt_page)] = 0; // Mark page as free
+    int first = vaddr >> PAGE_SHIFT;
+    int last = (vaddr + len - 1) >> PAGE_SHIFT;
 
-    // Free the page table pointer
-    mem[get_address(0, PTP_OFFSET + proc_num)] = 0; // Mark page as free
+    // Check the whole range first so a bad range changes nothing
+    for (int vpage = first; vpage <= last; vpage++) {
+        int page = walk_page(proc_num, vpage);
+        if (page == -1) {
+            printf("Error: Invalid virtual address\n");
+            return;
+        }
+        if (delta < 0 && pin_count[page] == 0) {
+            printf("Error: Page not pinned\n");
+            return;
+        }
+    }
+
+    for (int vpage = first; vpage <= last; vpage++) {
+        int page = walk_page(proc_num, vpage);
+        pin_count[page] += delta;
+        printf("%s proc %d: %02x -> %02x, count=%d\n",
+            delta > 0 ? "Pin": "Unpin", proc_num, vpage, page, pin_count[page]);
+    }
 }
 
 //
 // Store value at address sb
 //
 void store_byte(int proc_num, int vaddr, unsigned char val) {
-    unsigned char pt_page = get_page_table(proc_num);
-    int virtual_page = vaddr >> PAGE_SHIFT;
-    int offset = vaddr & 255;
-    int pt_addr = get_address(pt_page, virtual_page);
-    unsigned char phys_page = mem[pt_addr];
-    if (phys_page == 0) {
+    int phys_addr = virtual_to_physical(proc_num, vaddr);
+    if (phys_addr == -1) {
         printf("Error: Invalid virtual address\n");
         return;
     }
-    int phys_addr = get_address(phys_page, offset);
     mem[phys_addr] = val;
     printf("Store proc %d: %d => %d, value=%d\n", proc_num, vaddr, phys_addr, val);
 }
@@ -144,20 +2213,314 @@ void store_byte(int proc_num, int vaddr, unsigned char val) {
 // Load value from address lb
 //
 void load_byte(int proc_num, int vaddr) {
-    unsigned char pt_page = get_page_table(proc_num);
-    int virtual_page = vaddr >> PAGE_SHIFT;
-    int offset = vaddr & 255;
-    int pt_addr = get_address(pt_page, virtual_page);
-    unsigned char phys_page = mem[pt_addr];
-    if (phys_page == 0) {
+    int phys_addr = virtual_to_physical(proc_num, vaddr);
+    if (phys_addr == -1) {
         printf("Error: Invalid virtual address\n");
         return;
     }
-    int phys_addr = get_address(phys_page, offset);
     unsigned char val = mem[phys_addr];
     printf("Load proc %d: %d => %d, value=%d\n", proc_num, vaddr, phys_addr, val);
 }
 
+//
+// Flush a device's whole IOTLB and release frames waiting in its flush
+// queue
+//
+void iotlb_flush(int dev)
+{
+    for (int i = 0; i < IOTLB_ENTRIES; i++)
+        iotlb[dev][i].io_page = -1;
+
+    for (int i = 0; i < flush_queue_len[dev]; i++)
+        io_pin_count[flush_queue[dev][i].page]--;
+
+    flush_queue_len[dev] = 0;
+    iotlb_invalidations++;
+}
+
+//
+// Map IO virtual address iova on a device to the page backing a process
+// virtual address
+//
+// The page is pinned for as long as the device can reach it.
+//
+void iommu_map(int dev, int iova, int proc_num, int vaddr)
+{
+    int io_page = iova >> PAGE_SHIFT;
+
+    // Validate the device side before looking up the process's page
+    if (dev < 0 || dev >= DEV_COUNT || iova < 0 || io_page >= PAGE_COUNT) {
+        printf("Error: Invalid IO virtual address\n");
+        return;
+    }
+
+    if (io_page_table[dev][io_page] != 0) {
+        printf("Error: IO virtual address already mapped\n");
+        return;
+    }
+
+    // The IOTLB may still hold the old mapping until the next flush
+    for (int i = 0; i < flush_queue_len[dev]; i++) {
+        if (flush_queue[dev][i].io_page == io_page) {
+            printf("Error: IO virtual address awaiting IOTLB flush\n");
+            return;
+        }
+    }
+
+    int page = vaddr < 0? -1: walk_page(proc_num, vaddr >> PAGE_SHIFT);
+    if (page == -1) {
+        printf("Error: Invalid virtual address\n");
+        return;
+    }
+
+    io_page_table[dev][io_page] = page;
+    io_pin_count[page]++;
+
+    printf("IOMMU map dev %d: %02x -> %02x\n", dev, io_page, page);
+}
+
+//
+// Unmap IO virtual address iova on a device
+//
+// In strict mode the IOTLB entry is invalidated right away. In lazy mode
+// the page stays pinned on the flush queue, and the whole IOTLB is
+// flushed once the queue fills up.
+//
+void iommu_unmap(int dev, int iova)
+{
+    int io_page = iova >> PAGE_SHIFT;
+
+    if (dev < 0 || dev >= DEV_COUNT || iova < 0 || io_page >= PAGE_COUNT
+            || io_page_table[dev][io_page] == 0) {
+        printf("Error: Invalid IO virtual address\n");
+        return;
+    }
+
+    int page = io_page_table[dev][io_page];
+    io_page_table[dev][io_page] = 0;
+
+    if (iommu_lazy) {
+        struct flush_entry *f = &flush_queue[dev][flush_queue_len[dev]++];
+        f->io_page = io_page;
+        f->page = page;
+        if (flush_queue_len[dev] == FLUSH_QUEUE_SIZE)
+            iotlb_flush(dev);
+    } else {
+        for (int i = 0; i < IOTLB_ENTRIES; i++) {
+            if (iotlb[dev][i].io_page == io_page)
+                iotlb[dev][i].io_page = -1;
+        }
+        io_pin_count[page]--;
+        iotlb_invalidations++;
+    }
+
+    printf("IOMMU unmap dev %d: %02x\n", dev, io_page);
+}
+
+//
+// Switch between strict and lazy IOTLB invalidation
+//
+// Anything still on a flush queue is flushed so strict mode starts clean.
+//
+void set_iommu_mode(int lazy)
+{
+    for (int dev = 0; dev < DEV_COUNT; dev++) {
+        if (flush_queue_len[dev] > 0)
+            iotlb_flush(dev);
+    }
+
+    iommu_lazy = lazy;
+}
+
+//
+// Translate a device IO virtual address to a physical address
+//
+// Returns -1 if the IO page is not mapped.
+//
+int iova_to_physical(int dev, int iova)
+{
+    int io_page = iova >> PAGE_SHIFT;
+
+    if (dev < 0 || dev >= DEV_COUNT || iova < 0 || io_page >= PAGE_COUNT)
+        return -1;
+
+    for (int i = 0; i < IOTLB_ENTRIES; i++) {
+        if (iotlb[dev][i].io_page == io_page) {
+            iotlb_hits++;
+            return get_address(iotlb[dev][i].page, iova & OFFSET_MASK);
+        }
+    }
+
+    iotlb_misses++;
+
+    int page = io_page_table[dev][io_page];
+    if (page == 0)
+        return -1;
+
+    struct iotlb_entry *e = &iotlb[dev][iotlb_next[dev]];
+    iotlb_next[dev] = (iotlb_next[dev] + 1) % IOTLB_ENTRIES;
+    e->io_page = io_page;
+    e->page = page;
+
+    return get_address(page, iova & OFFSET_MASK);
+}
+
+//
+// DMA a byte from a device into memory
+//
+void dma_write(int dev, int iova, unsigned char val)
+{
+    int phys_addr = iova_to_physical(dev, iova);
+    if (phys_addr == -1) {
+        printf("Error: Invalid IO virtual address\n");
+        return;
+    }
+    mem[phys_addr] = val;
+    printf("DMA write dev %d: %d => %d, value=%d\n", dev, iova, phys_addr, val);
+}
+
+//
+// DMA a byte from memory to a device
+//
+void dma_read(int dev, int iova)
+{
+    int phys_addr = iova_to_physical(dev, iova);
+    if (phys_addr == -1) {
+        printf("Error: Invalid IO virtual address\n");
+        return;
+    }
+    unsigned char val = mem[phys_addr];
+    printf("DMA read dev %d: %d => %d, value=%d\n", dev, iova, phys_addr, val);
+}
+
+//
+// Print IOMMU statistics
+//
+void print_iommu_stats(void)
+{
+    printf("--- IOMMU (%s) ---\n", iommu_lazy? "lazy": "strict");
+    printf("iotlb hits: %d\n", iotlb_hits);
+    printf("iotlb misses: %d\n", iotlb_misses);
+    printf("iotlb invalidations: %d\n", iotlb_invalidations);
+}
+
+//
+// Print fragmentation of free memory
+//
+// For each order, this is how many naturally aligned free runs of
+// 2^order pages are available, i.e. how many allocations of that size
+// could succeed right now.
+//
+void print_fragmentation(void)
+{
+    int largest = 0;
+    int pinned = 0;
+    int pinned_blocks = 0;
+
+    for (int i = free_map_find(0, online_pages); i != -1;) {
+        int run = free_map_run(i, online_pages);
+        if (run > largest)
+            largest = run;
+        i = free_map_find(i + run, online_pages);
+    }
+
+    // Pinned pages can't be migrated, so their pageblocks can never be
+    // emptied to make a large free run
+    for (int b = 0; b < PAGEBLOCK_COUNT; b++) {
+        int end = (b + 1) * PAGEBLOCK_PAGES;
+        int in_block = 0;
+
+        for (int i = b * PAGEBLOCK_PAGES; i < end && i < online_pages; i++)
+            in_block += pin_count[i] != 0 || io_pin_count[i] != 0;
+
+        pinned += in_block;
+        pinned_blocks += in_block > 0;
+    }
+
+    printf("--- FRAGMENTATION ---\n");
+    printf("free pages: %d\n", free_pages);
+    printf("largest free run: %d\n", largest);
+    printf("pinned pages: %d in %d pageblocks\n", pinned, pinned_blocks);
+
+    for (int order = 0; order <= MAX_ORDER; order++) {
+        int size = 1 << order;
+        int count = 0;
+
+        for (int i = 0; i + size <= online_pages; i += size)
+            count += free_map_run(i, i + size) == size;
+
+        printf("order %d: %d\n", order, count);
+    }
+}
+
+//
+// Print translation statistics
+//
+void print_translation_stats(void)
+{
+    int total = range_hits + page_walks;
+    int reach = 0;
+
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        if (tlb[i].asid != -1)
+            reach += tlb[i].count;
+    }
+
+    printf("--- TRANSLATION ---\n");
+    printf("tlb hits: %d\n", tlb_hits);
+    printf("tlb misses: %d\n", tlb_misses);
+    printf("tlb evictions: %d\n", tlb_evictions);
+    printf("tlb ghost hits: %d\n", ghost_hits);
+    printf("tlb refaults: %d (%.1f%% of misses)\n", refaults,
+        tlb_misses? 100.0 * refaults / tlb_misses: 0.0);
+    printf("tlb thrash refaults: %d\n", thrash_refaults);
+    printf("refault activations: %d\n", refault_activations);
+
+    if (tlb_policy == POLICY_LECAR) {
+        printf("lecar weights: lru=%.3f lfu=%.3f\n", lecar_w_lru, 1 - lecar_w_lru);
+        printf("lecar lru weight every %d accesses:", LECAR_SAMPLE_INTERVAL);
+        for (int i = 0; i < lecar_sample_count; i++)
+            printf(" %.2f", lecar_samples[i]);
+        putchar('\n');
+    }
+
+    printf("tlb contiguous fills: %d\n", tlb_contig_fills);
+    printf("tlb reach: %d pages\n", reach);
+    printf("asid bits: %d\n", asid_bits);
+    printf("context switches: %d\n", context_switches);
+    printf("tlb flushes: %d\n", tlb_flushes);
+    printf("asid rollovers: %d\n", asid_rollovers);
+    printf("flushes per switch: %.3f\n",
+        context_switches? (double)tlb_flushes / context_switches: 0.0);
+    printf("tlb shootdowns: %d\n", tlb_shootdowns);
+    printf("shootdowns avoided: %d\n", shootdowns_avoided);
+    printf("flush epochs: %d\n", flush_epochs);
+    printf("deferred pages: %d (peak %d)\n", deferred_count, deferred_peak);
+    printf("segment hits (walks saved): %d\n", segment_hits);
+    printf("range hits: %d\n", range_hits);
+    printf("page walks: %d\n", page_walks);
+    printf("range coverage of misses: %.1f%%\n",
+        total? 100.0 * range_hits / total: 0.0);
+}
+
+//
+// Print superpage reservation statistics
+//
+void print_reservation_stats(void)
+{
+    int waste = 0;
+    for (int i = 0; i < PAGE_COUNT; i++)
+        waste += reserved[i];
+
+    printf("--- RESERVATIONS ---\n");
+    printf("reservations: %d\n", reservations_made);
+    printf("promotions: %d\n", promotions);
+    printf("broken: %d\n", reservations_broken);
+    printf("promotion rate: %.1f%%\n",
+        reservations_made? 100.0 * promotions / reservations_made: 0.0);
+    printf("reserved unused pages: %d\n", waste);
+}
+
 //
 // Print the free page map
 //
@@ -207,6 +2570,8 @@ void print_page_table(int proc_num)
 int main(int argc, char *argv[])
 {
     assert(PAGE_COUNT * PAGE_SIZE == MEM_SIZE);
+    assert(BOOT_PAGES % SECTION_PAGES == 0 && BOOT_PAGES >= SECTION_PAGES
+        && BOOT_PAGES <= PAGE_COUNT);
 
     if (argc == 1) {
         fprintf(stderr, "usage: ptsim commands\n");
@@ -214,14 +2579,48 @@ int main(int argc, char *argv[])
     }
     
     initialize_mem();
+    repl_reset();
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "pfm") == 0) {
             print_page_free_map();
         }
+        else if (strcmp(argv[i], "pfrag") == 0) {
+            print_fragmentation();
+        }
+        else if (strcmp(argv[i], "grouping") == 0) {
+            grouping = strcmp(argv[++i], "on") == 0;
+        }
+        else if (strcmp(argv[i], "ptplace") == 0) {
+            pt_region = strcmp(argv[++i], "region") == 0;
+        }
+        else if (strcmp(argv[i], "eager") == 0) {
+            eager = strcmp(argv[++i], "on") == 0;
+        }
+        else if (strcmp(argv[i], "reserve") == 0) {
+            reserve = strcmp(argv[++i], "on") == 0;
+        }
+        else if (strcmp(argv[i], "prsv") == 0) {
+            print_reservation_stats();
+        }
+        else if (strcmp(argv[i], "lazytlb") == 0) {
+            lazy_tlb = strcmp(argv[++i], "on") == 0;
+            if (!lazy_tlb && deferred_count > 0)
+                tlb_epoch();
+        }
+        else if (strcmp(argv[i], "tlbpolicy") == 0) {
+            set_tlb_policy(argv[++i]);
+        }
+        else if (strcmp(argv[i], "asidbits") == 0) {
+            set_asid_bits(atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "tstat") == 0) {
+            print_translation_stats();
+        }
         else if (strcmp(argv[i], "ppt") == 0) {
             int proc_num = atoi(argv[++i]);
-            print_page_table(proc_num);
+            if (valid_proc(proc_num))
+                print_page_table(proc_num);
         }
         else if (strcmp(argv[i], "np") == 0) {
             int proc_num = atoi(argv[++i]);
@@ -233,6 +2632,22 @@ int main(int argc, char *argv[])
             int proc_num = atoi(argv[++i]);
             kill_process(proc_num);
         }
+        else if (strcmp(argv[i], "npds") == 0) {
+            int proc_num = atoi(argv[++i]);
+            int page_count = atoi(argv[++i]);
+            int seg_pages = atoi(argv[++i]);
+            new_process_segment(proc_num, page_count, seg_pages);
+        }
+        else if (strcmp(argv[i], "npg") == 0) {
+            int group = atoi(argv[++i]);
+            int count = atoi(argv[++i]);
+            int page_count = atoi(argv[++i]);
+            new_process_group(group, count, page_count);
+        }
+        else if (strcmp(argv[i], "kpg") == 0) {
+            int group = atoi(argv[++i]);
+            kill_process_group(group);
+        }
         else if (strcmp(argv[i], "sb") == 0) {
             int proc_num = atoi(argv[++i]);
             int vaddr = atoi(argv[++i]);
@@ -244,5 +2659,51 @@ int main(int argc, char *argv[])
             int vaddr = atoi(argv[++i]);
             load_byte(proc_num, vaddr);
         }
+        else if (strcmp(argv[i], "pin") == 0 || strcmp(argv[i], "unpin") == 0) {
+            int delta = strcmp(argv[i], "pin") == 0? 1: -1;
+            int proc_num = atoi(argv[++i]);
+            int vaddr = atoi(argv[++i]);
+            int len = atoi(argv[++i]);
+            pin_range(proc_num, vaddr, len, delta);
+        }
+        else if (strcmp(argv[i], "iomap") == 0) {
+            int dev = atoi(argv[++i]);
+            int iova = atoi(argv[++i]);
+            int proc_num = atoi(argv[++i]);
+            int vaddr = atoi(argv[++i]);
+            iommu_map(dev, iova, proc_num, vaddr);
+        }
+        else if (strcmp(argv[i], "iounmap") == 0) {
+            int dev = atoi(argv[++i]);
+            int iova = atoi(argv[++i]);
+            iommu_unmap(dev, iova);
+        }
+        else if (strcmp(argv[i], "iomode") == 0) {
+            set_iommu_mode(strcmp(argv[++i], "lazy") == 0);
+        }
+        else if (strcmp(argv[i], "dmaw") == 0) {
+            int dev = atoi(argv[++i]);
+            int iova = atoi(argv[++i]);
+            unsigned char val = (unsigned char)atoi(argv[++i]);
+            dma_write(dev, iova, val);
+        }
+        else if (strcmp(argv[i], "dmar") == 0) {
+            int dev = atoi(argv[++i]);
+            int iova = atoi(argv[++i]);
+            dma_read(dev, iova);
+        }
+        else if (strcmp(argv[i], "iostat") == 0) {
+            print_iommu_stats();
+        }
+        else if (strcmp(argv[i], "balloon") == 0) {
+            int target = atoi(argv[++i]);
+            set_balloon(target);
+        }
+        else if (strcmp(argv[i], "memadd") == 0) {
+            mem_add();
+        }
+        else if (strcmp(argv[i], "memremove") == 0) {
+            mem_remove();
+        }
     }
 }